@@ -1,13 +1,23 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <SFML/Graphics.hpp>
 
 //For coloring the error outputs.
 const std::string error("\033[0;31m");
 const std::string reset("\033[0m");
 
-sf::RenderWindow window(sf::VideoMode(640, 320), "CHIP-8");
-
 //The chip8 fontset array I took from some other chip8 emulator.
 unsigned char chip8_fontset[80] =
 { 
@@ -30,6 +40,493 @@ unsigned char chip8_fontset[80] =
 };
 
 
+//A read-only memory mapping of a ROM file. Unmaps and closes itself when it goes out of scope.
+class RomFile {
+private:
+    int                  fd;
+    const unsigned char *data;
+    long                 filesize;
+    struct stat          status;
+
+    //Owns the fd and the mapping, so copying would unmap and close them twice. Not implemented.
+    RomFile(const RomFile&);
+    RomFile& operator=(const RomFile&);
+public:
+    RomFile() : fd(-1), data(NULL), filesize(0) { std::memset(&status, 0, sizeof(status)); }
+    ~RomFile() { close(); }
+    bool open(std::string);
+    void close();
+    const unsigned char *getData() { return data; }
+    long getSize() { return filesize; }
+    //The fstat of the open file, so it describes exactly what was mapped.
+    const struct stat& getStat() { return status; }
+};
+
+bool RomFile::open(std::string filename) {
+    close();
+
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+        close();
+        return false;
+    }
+
+    filesize = status.st_size;
+
+    //mmap can't map an empty file, so leave data as NULL.
+    if (filesize == 0) {
+        return true;
+    }
+
+    void *mapped = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close();
+        return false;
+    }
+
+    data = (const unsigned char*)mapped;
+    return true;
+}
+
+void RomFile::close() {
+    if (data != NULL) {
+        munmap((void*)data, filesize);
+        data = NULL;
+    }
+
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+
+    filesize = 0;
+    std::memset(&status, 0, sizeof(status));
+}
+
+
+//Opcodes whose behaviour differs between interpreters. If a ROM uses one of these it cares about that quirk.
+enum RomQuirk {
+    QUIRK_SHIFT      = 0x1, //8xy6/8xyE: shift Vx or Vy.
+    QUIRK_LOAD_STORE = 0x2, //Fx55/Fx65: whether index is incremented.
+    QUIRK_JUMP       = 0x4, //Bnnn: jump offset by V0 or Vx.
+    QUIRK_VF_RESET   = 0x8  //8xy1/8xy2/8xy3: whether vF is reset to 0.
+};
+
+//Everything the catalog knows about a ROM.
+struct RomInfo {
+    std::string         path;
+    unsigned long long  hash;
+    //What stat said when the ROM was hashed. If any of it changes, the ROM is looked at again.
+    long                size;
+    unsigned long       inode;
+    long                mtime;
+    long                mtimeNsec;
+    long                ctime;
+    long                ctimeNsec;
+    //quirks and rate are only reported by --catalog. The emulator doesn't act on them yet:
+    //it implements one behaviour per quirk and runs cycle() as fast as it can.
+    unsigned int        quirks;
+    //Instructions per second the ROM is likely to want.
+    int                 rate;
+    //Ranges of [start, end) addresses reachable as code. Everything else is treated as data.
+    std::vector<std::pair<unsigned short, unsigned short> > code;
+};
+
+//Bump this whenever the index format or anything analyze() produces changes, so old indexes get rebuilt.
+const std::string INDEX_VERSION("chip8-index 1");
+
+//Scans a directory of ROMs and keeps an on-disk index (".chip8-index") so a rescan only
+//has to stat each file. ROMs are identified by a hash of their contents, so a renamed or
+//copied ROM reuses the analysis that's already been done.
+class RomCatalog {
+private:
+    std::string             directory;
+    std::vector<RomInfo>    roms;
+    bool                    dirty;
+
+    std::string indexPath();
+    bool readIndex(std::map<std::string, RomInfo>&);
+    bool writeIndex();
+    static unsigned long long hash(const unsigned char*, long);
+    static void analyze(const unsigned char*, long, RomInfo&);
+    static void setStat(RomInfo&, const struct stat&);
+    static bool unchanged(const RomInfo&, const struct stat&);
+public:
+    RomCatalog() : dirty(false) {}
+    bool scan(std::string);
+    const std::vector<RomInfo>& getRoms() { return roms; }
+    void print();
+};
+
+std::string RomCatalog::indexPath() {
+    return directory + "/.chip8-index";
+}
+
+void RomCatalog::setStat(RomInfo &info, const struct stat &st) {
+    info.size      = st.st_size;
+    info.inode     = st.st_ino;
+    info.mtime     = st.st_mtim.tv_sec;
+    info.mtimeNsec = st.st_mtim.tv_nsec;
+    info.ctime     = st.st_ctim.tv_sec;
+    info.ctimeNsec = st.st_ctim.tv_nsec;
+}
+
+//Whole second mtime and size alone miss a same size rewrite within a second, and cp -p,
+//touch -r or tar can set mtime back. ctime can't be set from userspace, so check that too.
+bool RomCatalog::unchanged(const RomInfo &info, const struct stat &st) {
+    return info.size      == st.st_size
+        && info.inode     == st.st_ino
+        && info.mtime     == st.st_mtim.tv_sec
+        && info.mtimeNsec == st.st_mtim.tv_nsec
+        && info.ctime     == st.st_ctim.tv_sec
+        && info.ctimeNsec == st.st_ctim.tv_nsec;
+}
+
+//FNV-1a, 64 bit.
+unsigned long long RomCatalog::hash(const unsigned char *data, long size) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    for (long i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+void RomCatalog::analyze(const unsigned char *data, long size, RomInfo &info) {
+    //Program memory as the interpreter would see it, starting at 0x200.
+    unsigned char memory[4096] = { 0 };
+    bool visited[4096] = { false };
+    bool usesDelayTimer = false;
+    bool waitsForKey = false;
+
+    //scan already skips anything bigger, but the file could have grown since it was stat'd.
+    if (size > 4096 - 512) {
+        size = 4096 - 512;
+    }
+    if (size > 0) {
+        std::memcpy(memory + 512, data, size);
+    }
+
+    info.quirks = 0;
+    info.code.clear();
+
+    //Follow every path through the program from 0x200, marking what we reach as code.
+    std::vector<unsigned short> pending(1, 0x200);
+    while (!pending.empty()) {
+        unsigned short pc = pending.back();
+        pending.pop_back();
+
+        while (pc >= 512 && pc + 1 < 512 + size && !visited[pc]) {
+            visited[pc] = visited[pc + 1] = true;
+
+            unsigned short opcode = memory[pc] << 8 | memory[pc + 1];
+            unsigned short nnn = opcode & 0x0FFF;
+            bool stop = false;
+
+            switch (opcode & 0xF000) {
+                case 0x0000:
+                    //00EE returns, 0nnn (machine code routine) we can't follow.
+                    if (opcode != 0x00E0) {
+                        stop = true;
+                    }
+                break;
+
+                case 0x1000:
+                    pending.push_back(nnn);
+                    stop = true;
+                break;
+
+                case 0x2000:
+                    pending.push_back(nnn);
+                break;
+
+                //Skips: both the next and the one after are reachable.
+                case 0x3000:
+                case 0x4000:
+                case 0x5000:
+                case 0x9000:
+                    pending.push_back(pc + 4);
+                break;
+
+                case 0x8000:
+                    switch (opcode & 0x000F) {
+                        case 0x0001:
+                        case 0x0002:
+                        case 0x0003: info.quirks |= QUIRK_VF_RESET;      break;
+                        case 0x0006:
+                        case 0x000E: info.quirks |= QUIRK_SHIFT;         break;
+                    }
+                break;
+
+                //Target depends on V0, so there's nowhere we can follow.
+                case 0xB000:
+                    info.quirks |= QUIRK_JUMP;
+                    stop = true;
+                break;
+
+                case 0xE000:
+                    pending.push_back(pc + 4);
+                break;
+
+                case 0xF000:
+                    switch (opcode & 0x00FF) {
+                        case 0x0007: usesDelayTimer = true;              break;
+                        case 0x000A: waitsForKey = true;                 break;
+                        case 0x0055:
+                        case 0x0065: info.quirks |= QUIRK_LOAD_STORE;    break;
+                    }
+                break;
+            }
+
+            if (stop) {
+                break;
+            }
+            pc += 2;
+        }
+    }
+
+    //Turn the visited bytes in to ranges.
+    for (int addr = 512; addr < 512 + size; addr++) {
+        if (visited[addr] && (addr == 512 || !visited[addr - 1])) {
+            int end = addr;
+            while (end < 512 + size && visited[end]) {
+                end++;
+            }
+            info.code.push_back(std::make_pair((unsigned short)addr, (unsigned short)end));
+        }
+    }
+
+    //Games that time themselves with the delay timer or block on input are fine at the
+    //usual speed. Anything else (demos, pure drawing programs) can be run faster.
+    if (usesDelayTimer || waitsForKey) {
+        info.rate = 500;
+    } else {
+        info.rate = 1000;
+    }
+}
+
+/*
+Index format. The first line is INDEX_VERSION, then one ROM per line:
+    hash size inode mtime mtime_nsec ctime ctime_nsec quirks rate start-end,start-end,... path
+hash, quirks and the ranges are hex, everything else is decimal. The path comes last so it can contain spaces.
+*/
+bool RomCatalog::readIndex(std::map<std::string, RomInfo> &entries) {
+    std::ifstream in(indexPath().c_str());
+    if (!in) {
+        return false;
+    }
+
+    //Written by an older version (or not an index at all), so throw it away and start again.
+    std::string line;
+    if (!std::getline(in, line) || line != INDEX_VERSION) {
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        RomInfo info;
+        std::string ranges;
+
+        if (!(fields >> std::hex >> info.hash >> std::dec >> info.size >> info.inode
+                     >> info.mtime >> info.mtimeNsec >> info.ctime >> info.ctimeNsec
+                     >> std::hex >> info.quirks >> std::dec >> info.rate >> ranges)) {
+            continue;
+        }
+
+        fields.get();
+        if (!std::getline(fields, info.path) || info.path.empty()) {
+            continue;
+        }
+
+        //"-" means no reachable code at all.
+        if (ranges != "-") {
+            std::istringstream list(ranges);
+            std::string range;
+            while (std::getline(list, range, ',')) {
+                unsigned int start, end;
+                if (std::sscanf(range.c_str(), "%x-%x", &start, &end) == 2) {
+                    info.code.push_back(std::make_pair((unsigned short)start, (unsigned short)end));
+                }
+            }
+        }
+
+        entries[info.path] = info;
+    }
+
+    return true;
+}
+
+bool RomCatalog::writeIndex() {
+    //Write to a temporary file and rename it over the old one, so a crash never leaves half an index.
+    std::string tmp = indexPath() + ".tmp";
+    std::ofstream out(tmp.c_str());
+    if (!out) {
+        return false;
+    }
+
+    out << INDEX_VERSION << '\n';
+
+    for (size_t i = 0; i < roms.size(); i++) {
+        const RomInfo &info = roms[i];
+
+        out << std::hex << info.hash << ' ' << std::dec << info.size << ' ' << info.inode << ' '
+            << info.mtime << ' ' << info.mtimeNsec << ' ' << info.ctime << ' ' << info.ctimeNsec << ' '
+            << std::hex << info.quirks << ' ' << std::dec << info.rate << ' ';
+
+        if (info.code.empty()) {
+            out << '-';
+        }
+        for (size_t r = 0; r < info.code.size(); r++) {
+            out << (r ? "," : "") << std::hex << info.code[r].first << '-' << info.code[r].second << std::dec;
+        }
+
+        out << ' ' << info.path << '\n';
+    }
+
+    out.close();
+    if (!out) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    return std::rename(tmp.c_str(), indexPath().c_str()) == 0;
+}
+
+bool RomCatalog::scan(std::string dirname) {
+    directory = dirname;
+    roms.clear();
+    dirty = false;
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL) {
+        return false;
+    }
+
+    std::vector<std::string> names;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        //Skip hidden files, which includes the index itself.
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    //Keep the index in a stable order.
+    std::sort(names.begin(), names.end());
+
+    std::map<std::string, RomInfo> cached;
+    if (!readIndex(cached)) {
+        dirty = true;
+    }
+
+    //Analysis done this scan or loaded from the index, by content hash.
+    std::map<unsigned long long, const RomInfo*> byHash;
+    for (std::map<std::string, RomInfo>::iterator it = cached.begin(); it != cached.end(); ++it) {
+        byHash[it->second.hash] = &it->second;
+    }
+
+    roms.reserve(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string path = directory + "/" + names[i];
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        //load_ROM would refuse it, so don't bother hashing it (it might not even be a ROM).
+        if (st.st_size > 4096 - 512) {
+            std::cerr << error << path << " is too large to be a ROM, skipping." << reset << std::endl;
+            continue;
+        }
+
+        //Unchanged since the index was written, so there's no need to even open it.
+        std::map<std::string, RomInfo>::iterator hit = cached.find(names[i]);
+        if (hit != cached.end() && unchanged(hit->second, st)) {
+            roms.push_back(hit->second);
+            continue;
+        }
+
+        RomFile rom;
+        if (!rom.open(path)) {
+            std::cerr << error << "Could not open " << path << ", skipping." << reset << std::endl;
+            continue;
+        }
+
+        RomInfo info;
+        info.path  = names[i];
+        setStat(info, rom.getStat());
+        info.hash  = hash(rom.getData(), rom.getSize());
+
+        //Same contents as something we've already seen, just copy the analysis.
+        std::map<unsigned long long, const RomInfo*>::iterator same = byHash.find(info.hash);
+        if (same != byHash.end() && same->second->size == info.size) {
+            info.quirks = same->second->quirks;
+            info.rate   = same->second->rate;
+            info.code   = same->second->code;
+        } else {
+            analyze(rom.getData(), rom.getSize(), info);
+        }
+
+        roms.push_back(info);
+        byHash[info.hash] = &roms.back();
+        dirty = true;
+    }
+
+    //Also rewrite the index if ROMs have been removed since it was written.
+    if (roms.size() != cached.size()) {
+        dirty = true;
+    }
+
+    if (dirty) {
+        if (!writeIndex()) {
+            std::cerr << error << "Could not write " << indexPath() << reset << std::endl;
+        }
+        dirty = false;
+    }
+
+    return true;
+}
+
+void RomCatalog::print() {
+    for (size_t i = 0; i < roms.size(); i++) {
+        const RomInfo &info = roms[i];
+
+        std::cout << std::hex;
+        std::cout.width(16);
+        std::cout.fill('0');
+        std::cout << info.hash << std::dec;
+        std::cout.fill(' ');
+
+        std::cout << "  " << info.path << " (" << info.size << " bytes, " << info.rate << " ips)";
+
+        std::cout << " quirks:";
+        if (info.quirks == 0)                 { std::cout << " none"; }
+        if (info.quirks & QUIRK_SHIFT)        { std::cout << " shift"; }
+        if (info.quirks & QUIRK_LOAD_STORE)   { std::cout << " load/store"; }
+        if (info.quirks & QUIRK_JUMP)         { std::cout << " jump"; }
+        if (info.quirks & QUIRK_VF_RESET)     { std::cout << " vf-reset"; }
+
+        std::cout << " code:";
+        if (info.code.empty()) {
+            std::cout << " none";
+        }
+        for (size_t r = 0; r < info.code.size(); r++) {
+            std::cout << " " << std::hex << info.code[r].first << "-" << info.code[r].second << std::dec;
+        }
+
+        std::cout << std::endl;
+    }
+}
+
+
 class Chip8 {
 private:
     bool            drawFlag;
@@ -51,7 +548,7 @@ public:
     void keyPress(sf::Event);
     //Used to set keys[char] = int
     //draws the screen.
-    void render();
+    void render(sf::RenderWindow&);
     bool getDrawFlag();
     void clearScreen();
     void cycle();
@@ -105,7 +602,7 @@ void Chip8::keyRelease(sf::Event key) {
 }
 
 
-void Chip8::render() {
+void Chip8::render(sf::RenderWindow &window) {
     //For the entire height/width of the display:
     for (int x = 0; x < 64; x++) {
         for (int y = 0; y < 32; y++) {
@@ -142,49 +639,24 @@ void Chip8::clearScreen() {
 }
 
 bool Chip8::load_ROM(std::string filename) {
-    //Open the file in "read and binary" mode.
-    FILE *rom = std::fopen(filename.c_str(), "rb");
+    //Map the file instead of reading it in to a temporary buffer. It's unmapped when rom goes out of scope.
+    RomFile rom;
 
-    if (rom == NULL) {
+    if (!rom.open(filename)) {
         return false;
     }
 
-    //Get the size of the file.
-    fseek(rom, 0, SEEK_END);
-    long filesize = ftell(rom);
-    rewind(rom);
+    std::cout << "Filesize: " << rom.getSize() << std::endl;
 
-    std::cout << "Filesize: " << filesize << std::endl;
-
-    //Mate a char buffer the size of the file.
-    char *buff = (char*)malloc(sizeof(char) * filesize);
-
-    //If the buffer is null, malloc messed up somehow.
-    if (buff == NULL) {
-        std::cout << "ERROR ALLOCATING MEMORY!" << std::endl;
-        return false;
-    }
-
-    //Read data from rom stream in to buff.
-    int result = fread(buff, 1, filesize, rom);
-    if (result != filesize) {
-        std::cout << "ERROR READING ROM!" << std::endl;
-        return false;
-    }
-
-
-    //If filesize is less than 4096 (minus the 512 bytes that the rom can't be stored in)
-    if (filesize < (4096 - 512)) {
-        for (int i = 0; i < filesize; i++) {
-            memory[i + 512] = buff[i];
-        }
-    } else {
+    //If filesize is more than 4096 (minus the 512 bytes that the rom can't be stored in)
+    if (rom.getSize() > (4096 - 512)) {
         std::cout << "ROM too large!" << std::endl;
         return false;
     }
 
-    fclose(rom);
-    free(buff);
+    if (rom.getSize() > 0) {
+        std::memcpy(memory + 512, rom.getData(), rom.getSize());
+    }
 
     return true;
 }
@@ -615,9 +1087,23 @@ int main(int argc, char* argv[])
         std::cerr << error << "Error!" << reset << std::endl;
         std::cerr << error << "Usage:    ./main filename" << reset << std::endl;
         std::cerr << error << "Example:  ./main PONG" << reset << std::endl;
+        std::cerr << error << "Catalog:  ./main --catalog roms" << reset << std::endl;
         return 1;
     }
 
+    //List every ROM in a directory instead of running one.
+    if (std::string(argv[1]) == "--catalog") {
+        RomCatalog catalog;
+
+        if (!catalog.scan(argc > 2 ? argv[2] : "roms")) {
+            std::cerr << error << "Could not open ROM directory." << reset << std::endl;
+            return 1;
+        }
+
+        catalog.print();
+        return 0;
+    }
+
     Chip8 chip;
     chip.initialize();
 
@@ -626,6 +1112,8 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    //Only opened once there's a ROM to run, so --catalog never touches SFML.
+    sf::RenderWindow window(sf::VideoMode(640, 320), "CHIP-8");
 
     while (window.isOpen())
     {
@@ -633,7 +1121,7 @@ int main(int argc, char* argv[])
 
         //The screen needs drawn.
         if (chip.getDrawFlag()) {
-            chip.render();
+            chip.render(window);
             window.display();
         }
 